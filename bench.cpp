@@ -0,0 +1,234 @@
+// microbenchmarks for the compression, hashing and storage primitives in main.cpp, printed as JSON so the results of
+// two builds (or two zlib/OpenSSL versions) can be diffed. Build it with the same flags as main.cpp, e.g.
+//   g++ -std=c++17 -O2 bench.cpp -o bench -lz -lcrypto -pthread
+// usage: bench [--max-size=BYTES] [--min-time=MS] [--samples=N] [--corpus=DIR] [--filter=TEXT] [--out=FILE]
+#define BACKUP_NO_MAIN
+#include "main.cpp"
+#include <openssl/crypto.h>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+    volatile uint64_t sink; // results go here so the compiler cannot drop a call whose value is unused
+
+    struct Settings
+    {
+        size_t maxSize = 16 * 1024 * 1024; // --max-size=1073741824 for the full sweep
+        double minTime = 0.05; // seconds per sample
+        size_t samples = 5;
+        std::string corpus;
+        std::string filter;
+    };
+
+    // text made of common words, about as compressible as source code or logs
+    std::vector<char> makeText(size_t size, std::mt19937_64 &random)
+    {
+        static const char *words[] = {"the", "backup", "archive", "file", "chunk", "data", "int", "return", "void",
+                                      "const", "std::string", "for", "if", "else", "while", "size", "error", "hash",
+                                      "index", "storage", "manifest", "0", "1", "42", "{", "}", "(", ")", ";", "="};
+        std::vector<char> text;
+        text.reserve(size);
+        while (text.size() < size)
+        {
+            const char *word = words[random() % (sizeof(words) / sizeof(words[0]))];
+            text.insert(text.end(), word, word + std::strlen(word));
+            text.push_back(random() % 12 == 0 ? '\n' : ' ');
+        }
+        text.resize(size);
+        return text;
+    }
+
+    // every regular file under dir back to back, repeated until size bytes; empty if there is nothing to read
+    std::vector<char> makeCorpus(size_t size, const std::string &dir)
+    {
+        std::vector<char> corpus;
+        std::error_code error;
+        for (auto it = std::filesystem::recursive_directory_iterator(dir, error); !error && it != std::filesystem::recursive_directory_iterator() && corpus.size() < size; it.increment(error))
+        {
+            if (!it->is_regular_file())
+                continue;
+            std::ifstream file(it->path(), std::ios::binary);
+            std::vector<char> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            corpus.insert(corpus.end(), content.begin(), content.end());
+        }
+        if (corpus.empty())
+            return corpus;
+        for (size_t used = corpus.size(); corpus.size() < size;)
+            corpus.insert(corpus.end(), corpus.begin(), corpus.begin() + std::min(used, size - corpus.size()));
+        corpus.resize(size);
+        return corpus;
+    }
+
+    std::vector<char> makeData(const std::string &type, size_t size, const Settings &settings)
+    {
+        std::mt19937_64 random(42);
+        if (type == "zeros")
+            return std::vector<char>(size, 0);
+        if (type == "text")
+            return makeText(size, random);
+        if (type == "corpus")
+            return makeCorpus(size, settings.corpus);
+        std::vector<char> bytes(size);
+        for (size_t i = 0; i < size; i += 8)
+        {
+            uint64_t value = random();
+            std::memcpy(bytes.data() + i, &value, std::min<size_t>(8, size - i));
+        }
+        return bytes;
+    }
+
+    // runs op in samples of enough iterations to last minTime each; ns per op is reported per sample
+    nlohmann::json measure(const Settings &settings, size_t bytes, const std::function<void()> &op)
+    {
+        auto start = Clock::now();
+        op(); // warm up, and a first guess of the cost
+        double once = std::chrono::duration<double>(Clock::now() - start).count();
+        size_t iterations = std::max<size_t>(1, size_t(settings.minTime / std::max(once, 1e-9)));
+
+        std::vector<double> perOp;
+        for (size_t sample = 0; sample < settings.samples; ++sample)
+        {
+            start = Clock::now();
+            for (size_t i = 0; i < iterations; ++i)
+                op();
+            perOp.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations);
+        }
+        std::vector<double> sorted = perOp;
+        std::sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size() / 2];
+        if (sorted.size() % 2 == 0)
+            median = (sorted[sorted.size() / 2 - 1] + median) / 2;
+        double mean = 0, variance = 0;
+        for (double value : perOp)
+            mean += value / perOp.size();
+        for (double value : perOp)
+            variance += (value - mean) * (value - mean) / perOp.size();
+
+        return {{"iterations", iterations},
+                {"samples", perOp.size()},
+                {"ns_per_op", {{"median", median}, {"min", sorted.front()}, {"mean", mean}, {"stddev", std::sqrt(variance)}}},
+                {"mb_per_s", bytes / median * 1e9 / 1e6}};
+    }
+
+    std::string blobHash(uint64_t counter) // distinct, well formed hashes so every addFile stores a new blob
+    {
+        char hex[65];
+        std::snprintf(hex, sizeof(hex), "%064llx", static_cast<unsigned long long>(counter));
+        return hex;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        auto options = parseOptions(argc, argv, {"max-size", "min-time", "samples", "corpus", "filter", "out"});
+        Settings settings;
+        settings.maxSize = sizeOption(options, "max-size", settings.maxSize);
+        settings.minTime = sizeOption(options, "min-time", 50) / 1000.0;
+        settings.samples = std::max<size_t>(1, sizeOption(options, "samples", settings.samples));
+        settings.corpus = options.count("corpus") ? options["corpus"] : "";
+        settings.filter = options.count("filter") ? options["filter"] : "";
+
+        std::vector<std::string> codecs = {"zlib", "zlib:1", "store"};
+#ifdef WITH_ZSTD
+        codecs.push_back("zstd");
+#endif
+#ifdef WITH_LZ4
+        codecs.push_back("lz4");
+#endif
+        std::vector<std::string> types = {"random", "text", "zeros"};
+        if (!settings.corpus.empty())
+            types.push_back("corpus");
+
+        // storage benchmarks need a repository of their own, with the blob cache off so loadFile really inflates
+        std::filesystem::path workDirectory = std::filesystem::temp_directory_path() / ("backup-bench-" + std::to_string(std::random_device{}()));
+        std::filesystem::create_directories(workDirectory);
+        std::filesystem::path startDirectory = std::filesystem::current_path();
+        std::filesystem::current_path(workDirectory);
+
+        nlohmann::json results = nlohmann::json::array();
+        auto run = [&](const std::string &op, const std::string &type, size_t size, const std::function<void()> &body)
+        {
+            std::string name = op + "/" + type + "/" + std::to_string(size);
+            if (!settings.filter.empty() && name.find(settings.filter) == std::string::npos)
+                return;
+            std::cerr << name << "\n";
+            nlohmann::json result = measure(settings, size, body);
+            result["op"] = op;
+            result["data"] = type;
+            result["size"] = size;
+            results.push_back(result);
+        };
+
+        uint64_t counter = 0;
+        for (const auto &type : types)
+        {
+            std::vector<char> data = makeData(type, settings.maxSize, settings);
+            if (data.empty())
+                continue;
+            for (size_t size = 64; size <= settings.maxSize; size *= 16) // 64 B, 1 KiB, 16 KiB ... 1 GiB
+            {
+                const char *bytes = data.data();
+                for (const auto &codec : codecs)
+                {
+                    CompressionMethod method = parseCompression(codec);
+                    std::vector<char> compressed;
+                    run("compress/" + codec, type, size, [&] { compressed = compressData(bytes, size, method); });
+                    if (compressed.empty())
+                        compressed = compressData(bytes, size, method);
+                    run("decompress/" + codec, type, size, [&]
+                        {
+                            MemoryStreamBuffer buffer(compressed.data(), compressed.size());
+                            std::istream in(&buffer);
+                            decompressFromStream(method.codec, in, compressed.size(), size, [&](const char *, size_t length) { sink = length; });
+                        });
+                }
+
+                hashAlgorithm = HashAlgorithm::Sha256;
+                run("hash/sha256", type, size, [&] { sink = computeHash(bytes, size).size(); });
+                hashAlgorithm = HashAlgorithm::Blake3;
+                run("hash/blake3", type, size, [&] { sink = computeHash(bytes, size).size(); });
+                hashAlgorithm = HashAlgorithm::Sha256;
+                run("checksum/xxh64", type, size, [&] { sink = blobChecksum(bytes, size); });
+
+                {
+                    Storage storage;
+                    storage.setCacheSize(0);
+                    run("storage/addFile", type, size, [&] { storage.addFile(blobHash(++counter), bytes, size); });
+                    std::string stored = blobHash(++counter);
+                    storage.addFile(stored, bytes, size);
+                    run("storage/loadFile", type, size, [&] { sink = storage.loadFile(stored).size(); });
+                }
+                std::filesystem::remove_all("data"); // one fresh repository per case keeps the disk footprint small
+            }
+        }
+
+        std::filesystem::current_path(startDirectory);
+        std::filesystem::remove_all(workDirectory);
+
+        nlohmann::json report = {{"version", 1},
+                                 {"build", {{"compiler", __VERSION__}, {"zlib", zlibVersion()}, {"openssl", OpenSSL_version(OPENSSL_VERSION)}
+#ifdef WITH_ZSTD
+                                            , {"zstd", ZSTD_versionString()}
+#endif
+                                  }},
+                                 {"settings", {{"max_size", settings.maxSize}, {"min_time_ms", settings.minTime * 1000}, {"samples", settings.samples}}},
+                                 {"results", results}};
+        if (options.count("out"))
+        {
+            std::ofstream out(options["out"]);
+            out << report.dump(2) << "\n";
+        }
+        else
+        {
+            std::cout << report.dump(2) << "\n";
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,461 @@
+// end to end benchmark: generates a synthetic tree, then times the backup binary's create, check, extract and update
+// on it over several generations of mutations, with CPU time, peak RSS and I/O counters per command, as JSON.
+// Linux only (fork, wait4, /proc/<pid>/io). Build like bench.cpp:
+//   g++ -std=c++17 -O2 e2e.cpp -o e2e -lz -lcrypto -pthread
+// usage: e2e --backup=PATH [--work=DIR] [--files=N] [--size-median=BYTES] [--size-sigma=F] [--max-file=BYTES]
+//            [--depth=N] [--fanout=N] [--duplicates=F] [--compressible=F] [--mutate=F] [--generations=N]
+//            [--seed=N] [--args="extra backup options"] [--keep] [--out=FILE]
+#define BACKUP_NO_MAIN
+#include "main.cpp"
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+namespace
+{
+    double numberOption(const std::unordered_map<std::string, std::string> &options, const std::string &name, double defaultValue)
+    {
+        auto it = options.find(name);
+        if (it == options.end() || it->second.empty())
+            return defaultValue;
+        try
+        {
+            return std::stod(it->second);
+        }
+        catch (const std::exception &)
+        {
+            throw std::runtime_error("Invalid value for --" + name + ": " + it->second);
+        }
+    }
+
+    struct Shape
+    {
+        size_t files = 10000;
+        double sizeMedian = 8192;
+        double sizeSigma = 2.0; // of the log-normal file size distribution
+        size_t maxFile = 64 * 1024 * 1024;
+        size_t depth = 3;
+        size_t fanout = 8;
+        double duplicates = 0.1;   // share of files that copy another file's content
+        double compressible = 0.5; // share of 4 KiB blocks that are text rather than random bytes
+        double mutate = 0.05;      // share of files changed per generation; a quarter as many are deleted and added
+    };
+
+    // synthetic tree with a controllable shape; file contents are slices of two pools, so generating a million
+    // files costs little more than writing them
+    class Corpus
+    {
+        Shape shape;
+        std::mt19937_64 random;
+        std::string root;
+        std::vector<std::string> directories;
+        std::vector<std::string> files; // relative paths, empty once deleted
+        std::vector<char> randomPool, textPool;
+        size_t nextId = 0;
+        static constexpr size_t POOL_SIZE = 64 * 1024 * 1024;
+        static constexpr size_t BLOCK = 4096;
+
+        size_t fileSize()
+        {
+            std::lognormal_distribution<double> distribution(std::log(shape.sizeMedian), shape.sizeSigma);
+            return std::min<size_t>(shape.maxFile, size_t(distribution(random)));
+        }
+
+        std::vector<char> content(size_t size)
+        {
+            std::vector<char> bytes(size);
+            for (size_t offset = 0; offset < size; offset += BLOCK)
+            {
+                const std::vector<char> &pool = std::uniform_real_distribution<double>()(random) < shape.compressible ? textPool : randomPool;
+                size_t length = std::min(BLOCK, size - offset);
+                std::memcpy(bytes.data() + offset, pool.data() + random() % (POOL_SIZE - BLOCK), length);
+            }
+            uint64_t id = ++nextId; // no two generated files are alike unless they are meant to be
+            std::memcpy(bytes.data(), &id, std::min(size, sizeof(id)));
+            return bytes;
+        }
+
+        void write(const std::string &relative, const std::vector<char> &bytes)
+        {
+            std::string path = root + "/" + relative;
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0 || ::write(fd, bytes.data(), bytes.size()) != ssize_t(bytes.size()))
+            {
+                if (fd >= 0)
+                    ::close(fd);
+                throw std::runtime_error("Cannot write " + path);
+            }
+            ::close(fd);
+        }
+
+        std::vector<char> read(const std::string &relative)
+        {
+            std::ifstream file(root + "/" + relative, std::ios::binary);
+            return std::vector<char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        }
+
+        void addFile()
+        {
+            std::string relative = directories[random() % directories.size()] + "f" + std::to_string(files.size());
+            bool duplicate = !files.empty() && std::uniform_real_distribution<double>()(random) < shape.duplicates;
+            std::vector<char> bytes;
+            if (duplicate)
+            {
+                const std::string &original = files[random() % files.size()];
+                if (!original.empty())
+                    bytes = read(original);
+                else
+                    duplicate = false;
+            }
+            if (!duplicate)
+                bytes = content(fileSize());
+            write(relative, bytes);
+            files.push_back(relative);
+        }
+
+    public:
+        Corpus(const Shape &_shape, uint64_t seed, std::string _root) : shape(_shape), random(seed), root(std::move(_root))
+        {
+            randomPool.resize(POOL_SIZE);
+            for (size_t i = 0; i < POOL_SIZE; i += 8)
+            {
+                uint64_t value = random();
+                std::memcpy(randomPool.data() + i, &value, 8);
+            }
+            static const char *words[] = {"backup", "archive", "chunk", "the", "index", "return", "const", "file",
+                                          "std::vector", "data", "if", "(", ")", ";", "{", "}", "0", "size"};
+            while (textPool.size() < POOL_SIZE)
+            {
+                const char *word = words[random() % (sizeof(words) / sizeof(words[0]))];
+                textPool.insert(textPool.end(), word, word + std::strlen(word));
+                textPool.push_back(random() % 10 == 0 ? '\n' : ' ');
+            }
+        }
+
+        void generate()
+        {
+            std::filesystem::create_directories(root);
+            directories = {""};
+            for (size_t level = 0, first = 0; level < shape.depth; ++level)
+            {
+                size_t last = directories.size();
+                for (size_t parent = first; parent < last; ++parent)
+                {
+                    for (size_t child = 0; child < shape.fanout; ++child)
+                    {
+                        directories.push_back(directories[parent] + "d" + std::to_string(child) + "/");
+                        std::filesystem::create_directories(root + "/" + directories.back());
+                    }
+                }
+                first = last;
+            }
+            for (size_t i = 0; i < shape.files; ++i)
+                addFile();
+        }
+
+        // one generation of churn: changes a block in place in some files, deletes some and adds new ones
+        void mutate()
+        {
+            size_t changes = size_t(shape.files * shape.mutate);
+            for (size_t i = 0; i < changes; ++i)
+            {
+                std::string &relative = files[random() % files.size()];
+                if (relative.empty())
+                    continue;
+                std::vector<char> bytes = read(relative);
+                std::vector<char> block = content(std::min(BLOCK, bytes.size()));
+                size_t offset = bytes.size() > block.size() ? random() % (bytes.size() - block.size()) : 0;
+                std::copy(block.begin(), block.end(), bytes.begin() + offset);
+                write(relative, bytes);
+            }
+            for (size_t i = 0; i < changes / 4; ++i)
+            {
+                std::string &relative = files[random() % files.size()];
+                if (!relative.empty())
+                    std::filesystem::remove(root + "/" + relative);
+                relative.clear();
+            }
+            for (size_t i = 0; i < changes / 4; ++i)
+                addFile();
+        }
+
+        nlohmann::json describe() const
+        {
+            uint64_t count = 0, bytes = 0;
+            for (const auto &relative : files)
+            {
+                if (relative.empty())
+                    continue;
+                ++count;
+                bytes += std::filesystem::file_size(root + "/" + relative);
+            }
+            return {{"files", count}, {"bytes", bytes}, {"directories", directories.size()}};
+        }
+    };
+
+    uint64_t treeBytes(const std::string &dir)
+    {
+        uint64_t bytes = 0;
+        for (const auto &entry : std::filesystem::recursive_directory_iterator(dir))
+        {
+            if (entry.is_regular_file())
+                bytes += entry.file_size();
+        }
+        return bytes;
+    }
+
+    // /proc/<pid>/io of a child that has exited but not been reaped yet
+    nlohmann::json processIo(pid_t pid)
+    {
+        nlohmann::json io = nlohmann::json::object();
+        std::ifstream file("/proc/" + std::to_string(pid) + "/io");
+        std::string key;
+        uint64_t value;
+        while (file >> key >> value)
+        {
+            key.pop_back(); // the colon
+            io[key] = value;
+        }
+        return io;
+    }
+
+    // runs the backup binary in the repository directory, timing it from the outside
+    nlohmann::json runCommand(const std::string &binary, const std::string &repository, const std::vector<std::string> &arguments)
+    {
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(binary.c_str()));
+        for (const auto &argument : arguments)
+            argv.push_back(const_cast<char *>(argument.c_str()));
+        argv.push_back(nullptr);
+
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = ::fork();
+        if (pid < 0)
+            throw std::runtime_error("fork failed");
+        if (pid == 0)
+        {
+            int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDOUT_FILENO); // per file output would be timed too otherwise
+            if (::chdir(repository.c_str()) == 0)
+                ::execv(binary.c_str(), argv.data());
+            ::_exit(127);
+        }
+
+        siginfo_t info;
+        while (::waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0)
+        {
+            if (errno != EINTR)
+                throw std::runtime_error("waitid failed");
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        nlohmann::json io = processIo(pid);
+        int status = 0;
+        struct rusage usage;
+        ::wait4(pid, &status, 0, &usage);
+
+        std::string command;
+        for (const auto &argument : arguments)
+            command += (command.empty() ? "" : " ") + argument;
+        return {{"command", command},
+                {"exit", WIFEXITED(status) ? WEXITSTATUS(status) : -1},
+                {"wall_s", wall},
+                {"user_s", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6},
+                {"sys_s", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6},
+                {"max_rss_kb", usage.ru_maxrss},
+                {"read_syscalls", io.value("syscr", uint64_t(0))},
+                {"write_syscalls", io.value("syscw", uint64_t(0))},
+                {"bytes_read", io.value("rchar", uint64_t(0))},
+                {"bytes_written", io.value("wchar", uint64_t(0))},
+                {"device_bytes_written", io.value("write_bytes", uint64_t(0))}};
+    }
+
+    // a child forked before the corpus pools exist that starts every command: exec keeps the peak RSS of the
+    // process it replaces, so forking from here would report the pools as the backup binary's memory
+    class Launcher
+    {
+        int requests = -1, replies = -1;
+        pid_t pid = -1;
+
+        static void send(int fd, const std::string &message)
+        {
+            uint64_t size = message.size();
+            if (::write(fd, &size, sizeof(size)) != sizeof(size) || ::write(fd, message.data(), size) != ssize_t(size))
+                throw std::runtime_error("Launcher pipe broke");
+        }
+
+        static bool receive(int fd, std::string &message)
+        {
+            uint64_t size;
+            if (::read(fd, &size, sizeof(size)) != sizeof(size))
+                return false;
+            message.resize(size);
+            for (size_t done = 0; done < size;)
+            {
+                ssize_t got = ::read(fd, &message[done], size - done);
+                if (got <= 0)
+                    return false;
+                done += got;
+            }
+            return true;
+        }
+
+    public:
+        Launcher()
+        {
+            int down[2], up[2];
+            if (::pipe(down) != 0 || ::pipe(up) != 0)
+                throw std::runtime_error("pipe failed");
+            pid = ::fork();
+            if (pid < 0)
+                throw std::runtime_error("fork failed");
+            if (pid == 0)
+            {
+                ::close(down[1]);
+                ::close(up[0]);
+                std::string message;
+                while (receive(down[0], message))
+                {
+                    nlohmann::json request = nlohmann::json::parse(message);
+                    nlohmann::json reply;
+                    try
+                    {
+                        reply = runCommand(request["binary"], request["repository"], request["arguments"].get<std::vector<std::string>>());
+                    }
+                    catch (const std::exception &e)
+                    {
+                        reply = {{"error", e.what()}};
+                    }
+                    send(up[1], reply.dump());
+                }
+                ::_exit(0);
+            }
+            ::close(down[0]);
+            ::close(up[1]);
+            requests = down[1];
+            replies = up[0];
+        }
+
+        ~Launcher()
+        {
+            ::close(requests);
+            ::close(replies);
+            ::waitpid(pid, nullptr, 0);
+        }
+
+        nlohmann::json run(const std::string &binary, const std::string &repository, const std::vector<std::string> &arguments)
+        {
+            send(requests, nlohmann::json({{"binary", binary}, {"repository", repository}, {"arguments", arguments}}).dump());
+            std::string message;
+            if (!receive(replies, message))
+                throw std::runtime_error("Launcher died");
+            nlohmann::json reply = nlohmann::json::parse(message);
+            if (reply.contains("error"))
+                throw std::runtime_error(reply["error"].get<std::string>());
+            reply["repository_bytes"] = treeBytes(repository);
+            return reply;
+        }
+    };
+
+    std::vector<std::string> splitArguments(const std::string &text)
+    {
+        std::vector<std::string> words;
+        std::istringstream in(text);
+        for (std::string word; in >> word;)
+            words.push_back(word);
+        return words;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        Launcher launcher; // first, while this process is still small
+        auto options = parseOptions(argc, argv, {"backup", "work", "files", "size-median", "size-sigma", "max-file", "depth", "fanout",
+                                                 "duplicates", "compressible", "mutate", "generations", "seed", "args", "out"});
+        if (!options.count("backup"))
+        {
+            std::cerr << "Usage: e2e --backup=PATH [--work=DIR] [--files=N] [--size-median=BYTES] [--size-sigma=F] [--max-file=BYTES] "
+                         "[--depth=N] [--fanout=N] [--duplicates=F] [--compressible=F] [--mutate=F] [--generations=N] [--seed=N] "
+                         "[--args=\"...\"] [--keep] [--out=FILE]\n";
+            return 1;
+        }
+        std::string binary = std::filesystem::absolute(options["backup"]).string();
+        Shape shape;
+        shape.files = sizeOption(options, "files", shape.files);
+        shape.sizeMedian = numberOption(options, "size-median", shape.sizeMedian);
+        shape.sizeSigma = numberOption(options, "size-sigma", shape.sizeSigma);
+        shape.maxFile = sizeOption(options, "max-file", shape.maxFile);
+        shape.depth = sizeOption(options, "depth", shape.depth);
+        shape.fanout = std::max<size_t>(1, sizeOption(options, "fanout", shape.fanout));
+        shape.duplicates = numberOption(options, "duplicates", shape.duplicates);
+        shape.compressible = numberOption(options, "compressible", shape.compressible);
+        shape.mutate = numberOption(options, "mutate", shape.mutate);
+        size_t generations = std::max<size_t>(1, sizeOption(options, "generations", 3));
+        uint64_t seed = sizeOption(options, "seed", 1);
+        std::vector<std::string> extra = splitArguments(options.count("args") ? options["args"] : "");
+
+        // everything goes into an e2e-run directory of the harness' own, the only thing it ever deletes, so --work can
+        // safely name a directory that holds other files
+        std::filesystem::path base = options.count("work") ? std::filesystem::path(options["work"]) : std::filesystem::temp_directory_path() / ("backup-e2e-" + std::to_string(::getpid()));
+        std::string work = (std::filesystem::absolute(base) / "e2e-run").string();
+        std::string tree = work + "/tree", repository = work + "/repository", restore = work + "/restore";
+        std::filesystem::remove_all(work);
+        std::filesystem::create_directories(repository);
+
+        auto with = [&](std::vector<std::string> arguments) // command, extra options, then the positional arguments
+        {
+            arguments.insert(arguments.begin() + 1, extra.begin(), extra.end());
+            return arguments;
+        };
+
+        Corpus corpus(shape, seed, tree);
+        nlohmann::json report = {{"shape", {{"files", shape.files}, {"size_median", shape.sizeMedian}, {"size_sigma", shape.sizeSigma}, {"max_file", shape.maxFile}, {"depth", shape.depth}, {"fanout", shape.fanout}, {"duplicates", shape.duplicates}, {"compressible", shape.compressible}, {"mutate", shape.mutate}, {"seed", seed}}},
+                                 {"generations", nlohmann::json::array()}};
+        for (size_t generation = 0; generation < generations; ++generation)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (generation == 0)
+                corpus.generate();
+            else
+                corpus.mutate();
+            nlohmann::json result = {{"generation", generation}, {"tree", corpus.describe()}, {"generate_s", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()}};
+            std::cerr << "generation " << generation << ": " << result["tree"].dump() << "\n";
+
+            nlohmann::json commands = nlohmann::json::array();
+            commands.push_back(launcher.run(binary, repository, with({generation == 0 ? "create" : "update", "A", tree})));
+            commands.push_back(launcher.run(binary, repository, with({"check", "A", tree})));
+            std::filesystem::remove_all(restore);
+            commands.push_back(launcher.run(binary, repository, with({"extract", "A", restore})));
+            for (const auto &command : commands)
+            {
+                std::cerr << "  " << command["command"].get<std::string>() << ": " << command["wall_s"].get<double>() << "s\n";
+                if (command["exit"] != 0)
+                    throw std::runtime_error("Command failed: " + command["command"].get<std::string>());
+            }
+            result["commands"] = commands;
+            report["generations"].push_back(result);
+        }
+        if (!options.count("keep"))
+        {
+            std::filesystem::remove_all(work);
+            std::error_code error;
+            std::filesystem::remove(base, error); // only if nothing else is in it
+        }
+
+        if (options.count("out"))
+        {
+            std::ofstream out(options["out"]);
+            out << report.dump(2) << "\n";
+        }
+        else
+        {
+            std::cout << report.dump(2) << "\n";
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+// regression tests for storage behaviour that is hard to see from the command line. Build like bench.cpp:
+//   g++ -std=c++17 -O2 tests.cpp -o tests -lz -lcrypto -pthread
+// usage: tests [--filter=TEXT]; exits non-zero if any test fails
+#define BACKUP_NO_MAIN
+#include "main.cpp"
+
+namespace
+{
+    void expect(bool condition, const std::string &message)
+    {
+        if (!condition)
+            throw std::runtime_error(message);
+    }
+
+    // compressible and different for every seed, so solid blocks take it
+    std::vector<char> makeText(size_t size, uint64_t seed)
+    {
+        static const char *words[] = {"backup", "archive", "chunk", "storage", "manifest", "return", "const", "{", "}", ";"};
+        std::mt19937_64 random(seed);
+        std::string text = std::to_string(seed) + "\n";
+        while (text.size() < size)
+        {
+            text += words[random() % (sizeof(words) / sizeof(words[0]))];
+            text += random() % 12 == 0 ? '\n' : ' ';
+        }
+        return std::vector<char>(text.begin(), text.begin() + size);
+    }
+
+    // solid blocks bigger than a quarter of the cache must still be inflated once, not once per file in them
+    void solidBlockLargerThanCache()
+    {
+        const size_t BLOB_SIZE = 48 * 1024, BLOBS = 700; // about 33 MB, two 32 MiB blocks
+        std::vector<std::string> hashes;
+        {
+            Storage storage;
+            storage.setSolidBlockSize(32 * 1024 * 1024);
+            for (size_t i = 0; i < BLOBS; ++i)
+            {
+                std::vector<char> blob = makeText(BLOB_SIZE, i);
+                hashes.push_back(computeHash(blob));
+                storage.addFile(hashes.back(), blob.data(), blob.size());
+            }
+            storage.saveToFile("index.bin");
+        }
+
+        Storage storage;
+        storage.setCacheSize(64 * 1024 * 1024);
+        storage.loadFromFile("index.bin");
+        for (size_t i = 0; i < BLOBS; ++i)
+            expect(storage.loadFile(hashes[i]) == makeText(BLOB_SIZE, i), "blob " + std::to_string(i) + " differs");
+        uint64_t misses = storage.blobCache().misses();
+        expect(misses <= 4, "solid blocks inflated " + std::to_string(misses) + " times");
+    }
+
+    // --cache=0 keeps nothing, not even the last few solid blocks
+    void cacheOffKeepsNothing()
+    {
+        BlobCache cache(0);
+        auto block = std::make_shared<const std::vector<char>>(makeText(4096, 1));
+        cache.insert("block:1:0", block, true);
+        cache.insert("blob", block);
+        expect(!cache.find("block:1:0") && !cache.find("blob"), "disabled cache kept an entry");
+    }
+
+    // with dict-255 taken the next id must be a free one, not 255 + 1 wrapping to 0 ("no dictionary")
+    void dictionaryIdAfterTopId()
+    {
+        std::filesystem::create_directories("data");
+        {
+            std::ofstream out("data/dict-255.bin", std::ios::binary);
+            std::vector<char> seed = makeText(4096, 0);
+            out.write(seed.data(), seed.size());
+        }
+        Storage storage;
+        for (size_t i = 1; i <= 64; ++i)
+        {
+            std::vector<char> blob = makeText(4096, i);
+            storage.addFile(computeHash(blob), blob.data(), blob.size());
+        }
+        size_t samples = 0;
+        uint8_t id = storage.trainDictionary(1024, samples);
+        expect(id == 1, "new dictionary got id " + std::to_string(id));
+
+        std::vector<char> blob = makeText(4096, 1000); // goes against the new dictionary and must come back intact
+        std::string hash = computeHash(blob);
+        storage.addFile(hash, blob.data(), blob.size());
+        expect(storage.loadFile(hash) == blob, "blob stored with the new dictionary differs");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    auto options = parseOptions(argc, argv, {"filter"});
+    std::string filter = options.count("filter") ? options["filter"] : "";
+    std::vector<std::pair<std::string, std::function<void()>>> tests = {
+        {"solidBlockLargerThanCache", solidBlockLargerThanCache},
+        {"dictionaryIdAfterTopId", dictionaryIdAfterTopId},
+        {"cacheOffKeepsNothing", cacheOffKeepsNothing},
+    };
+
+    // every test gets an empty repository of its own
+    std::filesystem::path startDirectory = std::filesystem::current_path();
+    std::filesystem::path workDirectory = std::filesystem::temp_directory_path() / "backup-tests";
+    int failed = 0;
+    for (const auto &[name, test] : tests)
+    {
+        if (!filter.empty() && name.find(filter) == std::string::npos)
+            continue;
+        std::filesystem::remove_all(workDirectory);
+        std::filesystem::create_directories(workDirectory);
+        std::filesystem::current_path(workDirectory);
+        try
+        {
+            test();
+            std::cout << "ok      " << name << "\n";
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "FAILED  " << name << ": " << e.what() << "\n";
+            ++failed;
+        }
+        std::filesystem::current_path(startDirectory);
+    }
+    std::filesystem::remove_all(workDirectory);
+    return failed == 0 ? 0 : 1;
+}